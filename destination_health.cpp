@@ -0,0 +1,177 @@
+#include <algorithm>
+
+#include "destination_health.h"
+
+HealthConfig::HealthConfig():
+failureThreshold(2),
+backoff(std::chrono::seconds(10)),
+maxBackoff(std::chrono::seconds(300)),
+probeProbability(0.05),
+entryLifetime(std::chrono::minutes(10)),
+maxEntries(4096)
+{
+}
+
+DestinationHealth::Entry::Entry():
+failures(0),
+probing(false),
+lastStatus(ConnectionStatus::Granted),
+retryAfter(),
+updated(),
+latency(Clock::duration::zero())
+{
+}
+
+DestinationHealth::DestinationHealth(const HealthConfig& config):
+config(config),
+entries(),
+random(std::random_device()())
+{
+}
+
+void DestinationHealth::configure(const HealthConfig& config)
+{
+    this->config = config;
+}
+
+bool DestinationHealth::arrange(std::vector<Endpoint>& endpoints, ConnectionStatus& cachedStatus)
+{
+    struct Candidate
+    {
+        Endpoint endpoint;
+        int rank;                                   // 0 healthy, 1 unknown, 2 failing, 3 probing
+        Clock::duration latency;
+    };
+    
+    auto const& now = Clock::now();
+    std::bernoulli_distribution probe(config.probeProbability);
+    std::vector<Candidate> candidates;
+    bool skipped = false;
+    for(auto const& endpoint : endpoints)
+    {
+        auto found = entries.find(endpoint);
+        if(found == entries.end())
+        {
+            candidates.push_back(Candidate{endpoint, 1, Clock::duration::zero()});
+            continue;
+        }
+        
+        auto const& entry = found->second;
+        if(now < entry.retryAfter)
+        {
+            if(probe(random))
+                candidates.push_back(Candidate{endpoint, 3, Clock::duration::zero()});
+            else if(!skipped)
+            {
+                cachedStatus = entry.lastStatus;
+                skipped = true;
+            }
+        }
+        else if(entry.failures != 0)
+            candidates.push_back(Candidate{endpoint, 2, Clock::duration::zero()});
+        else
+            candidates.push_back(Candidate{endpoint, 0, entry.latency});
+    }
+    
+    // Stable, so resolver order still breaks ties.
+    std::stable_sort(candidates.begin(), candidates.end(), [](Candidate const& a, Candidate const& b){
+        return a.rank < b.rank || (a.rank == b.rank && a.latency < b.latency);
+    });
+    endpoints.clear();
+    for(auto const& candidate : candidates)
+        endpoints.push_back(candidate.endpoint);
+    return !endpoints.empty();
+}
+
+void DestinationHealth::recordAttempt(const Endpoint& endpoint)
+{
+    // Dialling inside the back-off window only happens for probes.
+    auto found = entries.find(endpoint);
+    if(found != entries.end() && Clock::now() < found->second.retryAfter)
+        found->second.probing = true;
+}
+
+void DestinationHealth::recordSuccess(const Endpoint& endpoint, Clock::duration latency)
+{
+    auto& entry = touch(endpoint, Clock::now());
+    if(entry.failures != 0 || entry.latency == Clock::duration::zero())
+        entry.latency = latency;
+    else
+        entry.latency += (latency - entry.latency) / 8;
+    entry.failures = 0;
+    entry.probing = false;
+    entry.lastStatus = ConnectionStatus::Granted;
+    entry.retryAfter = Clock::time_point();
+}
+
+void DestinationHealth::recordFailure(const Endpoint& endpoint, ConnectionStatus status)
+{
+    switch(status)
+    {
+        case ConnectionStatus::NetworkUnreachable:
+        case ConnectionStatus::HostUnreachable:
+        case ConnectionStatus::ConnectionRefused:
+        case ConnectionStatus::TtlExpired:
+            break;
+        default:
+            return;                                 // Not a property of the destination
+    }
+    
+    auto const& now = Clock::now();
+    auto& entry = touch(endpoint, now);
+    entry.lastStatus = status;
+    
+    // Connects already in flight when the window opened fail together; only
+    // the first failure after it closes, or a probe, counts towards the next.
+    if(now < entry.retryAfter && !entry.probing)
+        return;
+    entry.probing = false;
+    if(++entry.failures >= config.failureThreshold)
+    {
+        auto window = config.backoff;
+        for(auto i = config.failureThreshold; i < entry.failures && window < config.maxBackoff; ++i)
+            window *= 2;
+        entry.retryAfter = now + std::min(window, config.maxBackoff);
+    }
+}
+
+DestinationHealth::Entry& DestinationHealth::touch(const Endpoint& endpoint, Clock::time_point now)
+{
+    if(entries.size() >= config.maxEntries && entries.find(endpoint) == entries.end())
+        prune(now);
+    auto& entry = entries[endpoint];
+    if(stale(entry, now))
+        entry.failures = 0;                         // Too old to count as consecutive
+    entry.updated = now;
+    return entry;
+}
+
+// Counted from the end of the back-off window, so a window longer than
+// entryLifetime does not wipe the failures it was based on.
+bool DestinationHealth::stale(const Entry& entry, Clock::time_point now) const
+{
+    return now - std::max(entry.updated, entry.retryAfter) > config.entryLifetime;
+}
+
+void DestinationHealth::prune(Clock::time_point now)
+{
+    for(auto i = entries.begin(); i != entries.end();)
+    {
+        if(stale(i->second, now))
+            i = entries.erase(i);
+        else
+            ++i;
+    }
+    if(!entries.empty() && entries.size() >= config.maxEntries)
+    {
+        entries.erase(std::min_element(entries.begin(), entries.end(), [](std::pair<Endpoint const, Entry> const& a, std::pair<Endpoint const, Entry> const& b){
+            return a.second.updated < b.second.updated;
+        }));
+    }
+}
+
+DestinationHealth& destinationHealth()
+{
+    static DestinationHealth health;
+    return health;
+}
@@ -0,0 +1,72 @@
+#ifndef _C42F5638_CB87_11F1_BC90_02FC00000001
+#define _C42F5638_CB87_11F1_BC90_02FC00000001
+
+#include <chrono>
+#include <map>
+#include <random>
+#include <vector>
+
+#include <boost/asio/ip/tcp.hpp>
+
+#include "protocol_types.h"
+
+struct HealthConfig
+{
+    HealthConfig();
+    
+    unsigned failureThreshold;                      // Consecutive failures before backing off
+    std::chrono::steady_clock::duration backoff;    // First back-off window, doubled per further failure
+    std::chrono::steady_clock::duration maxBackoff;
+    double probeProbability;                        // Chance to retry a backed-off endpoint anyway
+    std::chrono::steady_clock::duration entryLifetime;
+    std::size_t maxEntries;
+};
+
+// Remembers recent connect outcomes per resolved endpoint, so that repeated
+// connects to a dead destination fail fast instead of waiting out a timeout.
+class DestinationHealth
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+    typedef boost::asio::ip::tcp::endpoint Endpoint;
+    
+    explicit DestinationHealth(HealthConfig const& config = HealthConfig());
+    
+    void configure(HealthConfig const& config);
+    
+    // Drops endpoints that are backing off and orders the rest, healthy and
+    // fast ones first. Returns false with the cached status if none is left.
+    bool arrange(std::vector<Endpoint>& endpoints, ConnectionStatus& cachedStatus);
+    
+    void recordAttempt(Endpoint const& endpoint);
+    void recordSuccess(Endpoint const& endpoint, Clock::duration latency);
+    void recordFailure(Endpoint const& endpoint, ConnectionStatus status);
+    
+    DestinationHealth(DestinationHealth const&) = delete;
+    DestinationHealth& operator = (DestinationHealth const&) = delete;
+    
+private:
+    struct Entry
+    {
+        Entry();
+        
+        unsigned failures;
+        bool probing;                               // A probe is being dialled inside the back-off window
+        ConnectionStatus lastStatus;
+        Clock::time_point retryAfter;
+        Clock::time_point updated;
+        Clock::duration latency;                    // Smoothed connect latency, zero if unknown
+    };
+    
+    Entry& touch(Endpoint const& endpoint, Clock::time_point now);
+    bool stale(Entry const& entry, Clock::time_point now) const;
+    void prune(Clock::time_point now);
+    
+    HealthConfig config;
+    std::map<Endpoint, Entry> entries;
+    std::mt19937 random;
+};
+
+DestinationHealth& destinationHealth();
+
+#endif
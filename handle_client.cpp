@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <array>
 #include <chrono>
 #include <type_traits>
 
@@ -12,14 +13,25 @@
 
 #include "handle_client.h"
 
+#include "destination_health.h"
 #include "error_handler.h"
 #include "logging.h"
 #include "protocol_types.h"
 #include "rules.h"
+#include "tracing.h"
 
 static unsigned activeCount = 0;
 static unsigned maxActive = 0;
 
+static bool optimisticData = false;
+static std::size_t const earlyDataSize = 16 * 1024;
+static std::chrono::milliseconds const replyCoalesceDelay(50);
+
+void setOptimisticData(bool enabled)
+{
+    optimisticData = enabled;
+}
+
 struct ControlBlock
 {
     ControlBlock(TCPSocket&& peer, TCPEndpoint&& peer_endpoint):
@@ -31,7 +43,14 @@ struct ControlBlock
     clientGreeting(),
     serverGreeting(),
     connectionRequest(),
-    connectionResponse()
+    connectionResponse(),
+    targetEndpoints(),
+    earlyData(),
+    earlyBytes(0),
+    earlyPending(false),
+    connected(false),
+    relayBufferSize(0),
+    trace(new SessionTrace)
     {
         ++activeCount;
         logging::debug("Construct ControlBlock, %1%/%2% active.", activeCount, maxActive = std::max(activeCount, maxActive));
@@ -55,36 +74,139 @@ struct ControlBlock
     ConnectionRequest connectionRequest;
     std::vector<char> connectionResponse;
     
+    std::vector<TCPEndpoint> targetEndpoints;
+    
+    std::shared_ptr<std::vector<char>> earlyData;
+    std::size_t earlyBytes;
+    bool earlyPending;
+    bool connected;
+    std::size_t relayBufferSize;
+    
+    std::shared_ptr<SessionTrace> trace;
+    
     ControlBlock(ControlBlock const&) = delete;
     ControlBlock& operator = (ControlBlock const&) = delete;
 };
 
-void forwardSingle(std::shared_ptr<TCPSocket> from, std::shared_ptr<TCPSocket> to, std::shared_ptr<std::vector<char>> buf)
+static void stopForwarding(std::shared_ptr<TCPSocket> const& from, std::shared_ptr<TCPSocket> const& to)
+{
+    using boost::asio::socket_base;
+    boost::system::error_code error;
+    from->shutdown(socket_base::shutdown_receive, error);
+    to->shutdown(socket_base::shutdown_send, error);
+}
+
+void forwardSingle(std::shared_ptr<TCPSocket> from, std::shared_ptr<TCPSocket> to, std::shared_ptr<std::vector<char>> buf,
+                   std::shared_ptr<SessionTrace> trace, RelayDirection direction);
+
+static void relayChunk(std::shared_ptr<TCPSocket> from, std::shared_ptr<TCPSocket> to, std::shared_ptr<std::vector<char>> buf, std::size_t bytes,
+                       std::shared_ptr<SessionTrace> trace, RelayDirection direction)
 {
     using boost::asio::buffer;
     using boost::asio::async_write;
-    using boost::asio::socket_base;
     using boost::system::error_code;
-    from->async_receive(buffer(*buf), error_branch([from, to, buf](error_code const&){
-        error_code error;
-        from->shutdown(socket_base::shutdown_receive, error);
-        to->shutdown(socket_base::shutdown_send, error);
-    }, [from, to, buf](std::size_t bytes){
-        async_write(*to, buffer(*buf, bytes), error_branch([from, to, buf](error_code const&){
-            error_code error;
-            from->shutdown(socket_base::shutdown_receive, error);
-            to->shutdown(socket_base::shutdown_send, error);
-        }, [from, to, buf](std::size_t){
-            forwardSingle(std::move(from), std::move(to), std::move(buf));
-        }));
+    async_write(*to, buffer(*buf, bytes), error_branch([from, to](error_code const&){
+        stopForwarding(from, to);
+    }, [from, to, buf, trace, direction](std::size_t bytes){
+        YASOCKS_PROBE3(relay__write, trace->id(), static_cast<int>(direction), bytes);
+        trace->addBytes(direction, bytes);
+        forwardSingle(std::move(from), std::move(to), std::move(buf), std::move(trace), direction);
+    }));
+}
+
+void forwardSingle(std::shared_ptr<TCPSocket> from, std::shared_ptr<TCPSocket> to, std::shared_ptr<std::vector<char>> buf,
+                   std::shared_ptr<SessionTrace> trace, RelayDirection direction)
+{
+    using boost::asio::buffer;
+    using boost::system::error_code;
+    from->async_receive(buffer(*buf), error_branch([from, to](error_code const&){
+        stopForwarding(from, to);
+    }, [from, to, buf, trace, direction](std::size_t bytes){
+        YASOCKS_PROBE3(relay__read, trace->id(), static_cast<int>(direction), bytes);
+        relayChunk(std::move(from), std::move(to), std::move(buf), bytes, std::move(trace), direction);
     }));
 }
 
-void forwardBoth(TCPSocket&& peer, TCPSocket&& target, std::size_t bufSize)
+// Sends the CONNECT reply in one write with the target's first bytes if they
+// arrive within replyCoalesceDelay, or on its own once the delay is over.
+static void forwardReply(std::shared_ptr<TCPSocket> from, std::shared_ptr<TCPSocket> to, std::shared_ptr<std::vector<char>> buf,
+                         std::shared_ptr<SessionTrace> trace, std::shared_ptr<std::vector<char>> reply)
+{
+    using boost::asio::buffer;
+    using boost::asio::async_write;
+    using boost::system::error_code;
+    
+    std::shared_ptr<bool> decided(new bool(false));
+    std::shared_ptr<boost::asio::steady_timer> timer(new boost::asio::steady_timer(from->get_io_service(), replyCoalesceDelay));
+    auto const& send = [from, to, buf, trace, reply](std::size_t bytes){
+        std::array<boost::asio::const_buffer, 2> const buffers = {{ buffer(*reply), buffer(*buf, bytes) }};
+        async_write(*to, buffers, error_branch([from, to](error_code const&){
+            stopForwarding(from, to);
+        }, [from, to, buf, trace, reply, bytes](std::size_t){
+            if(bytes != 0)
+            {
+                YASOCKS_PROBE3(relay__write, trace->id(), static_cast<int>(RelayDirection::Downstream), bytes);
+                trace->addBytes(RelayDirection::Downstream, bytes);
+            }
+            forwardSingle(std::move(from), std::move(to), std::move(buf), std::move(trace), RelayDirection::Downstream);
+        }));
+    };
+    
+    timer->async_wait([decided, send](error_code const&){
+        if(*decided)
+            return;
+        *decided = true;
+        send(0);
+    });
+    // Only wait for readability, so a late answer is left for forwardSingle.
+    from->async_receive(boost::asio::null_buffers(), [from, buf, trace, decided, timer, send](error_code const& e, std::size_t){
+        if(*decided)
+            return;
+        *decided = true;
+        error_code error;
+        timer->cancel(error);
+        std::size_t bytes = 0;
+        if(!e)
+        {
+            // Readiness need not mean data (urgent bytes, for one), and a
+            // blocking read here would stall every session.
+            from->non_blocking(true, error);
+            if(!error)
+                bytes = from->receive(buffer(*buf), 0, error);
+            if(error)
+                bytes = 0;                      // Would block, or an error the relay sees again
+            else
+                YASOCKS_PROBE3(relay__read, trace->id(), static_cast<int>(RelayDirection::Downstream), bytes);
+            from->non_blocking(false, error);
+        }
+        send(bytes);
+    });
+}
+
+// Starts relaying in both directions. Early client data, if any, is written
+// to the target first; a pending reply goes to the peer through forwardReply.
+void forwardBoth(TCPSocket&& peer, TCPSocket&& target, std::size_t bufSize, std::shared_ptr<SessionTrace> trace,
+                 std::shared_ptr<std::vector<char>> early, std::size_t earlyBytes, std::shared_ptr<std::vector<char>> reply)
 {
     std::shared_ptr<TCPSocket> ptrPeer(new TCPSocket(std::move(peer))), ptrTarget(new TCPSocket(std::move(target)));
-    forwardSingle(ptrPeer, ptrTarget, std::shared_ptr<std::vector<char>>(new std::vector<char>(bufSize)));
-    forwardSingle(ptrTarget, ptrPeer, std::shared_ptr<std::vector<char>>(new std::vector<char>(bufSize)));
+    if(earlyBytes != 0)
+    {
+        early->resize(std::max(bufSize, earlyBytes));
+        relayChunk(ptrPeer, ptrTarget, std::move(early), earlyBytes, trace, RelayDirection::Upstream);
+    }
+    else
+        forwardSingle(ptrPeer, ptrTarget, std::shared_ptr<std::vector<char>>(new std::vector<char>(bufSize)), trace, RelayDirection::Upstream);
+    
+    std::shared_ptr<std::vector<char>> down(new std::vector<char>(bufSize));
+    if(reply)
+        forwardReply(ptrTarget, ptrPeer, std::move(down), std::move(trace), std::move(reply));
+    else
+        forwardSingle(ptrTarget, ptrPeer, std::move(down), std::move(trace), RelayDirection::Downstream);
+}
+
+void forwardBoth(TCPSocket&& peer, TCPSocket&& target, std::size_t bufSize, std::shared_ptr<SessionTrace> trace)
+{
+    forwardBoth(std::move(peer), std::move(target), bufSize, std::move(trace), nullptr, 0, nullptr);
 }
 
 template <typename T>
@@ -166,15 +288,113 @@ static void sendConnError(ConnectionStatus status, std::shared_ptr<ControlBlock>
     using boost::asio::buffer;
     using boost::asio::async_read;
     using boost::asio::async_write;
+    boost::system::error_code error;
+    cb->peer.cancel(error);                     // Drop a pending optimistic read
     makeConnectionResponse(status, cb->connectionResponse);
     async_write(cb->peer, buffer(cb->connectionResponse), nosize("async_write", [cb]{}));
 }
 
-static void serve_connect(std::shared_ptr<ControlBlock> cb)
+static void relayConnected(std::shared_ptr<ControlBlock> cb)
 {
     using boost::asio::buffer;
-    using boost::asio::async_read;
     using boost::asio::async_write;
+    
+    auto bufSize = cb->relayBufferSize;
+    if(cb->earlyBytes == 0)
+    {
+        async_write(cb->peer, buffer(cb->connectionResponse), nosize("async_write", [cb, bufSize]{
+            forwardBoth(std::move(cb->peer), std::move(cb->target), bufSize, cb->trace);
+        }));
+        return;
+    }
+    
+    // The client has already spoken, so the target is likely to answer soon:
+    // let the reply wait briefly for the first bytes of that answer.
+    std::shared_ptr<std::vector<char>> reply(new std::vector<char>(std::move(cb->connectionResponse)));
+    forwardBoth(std::move(cb->peer), std::move(cb->target), bufSize, cb->trace, std::move(cb->earlyData), cb->earlyBytes, std::move(reply));
+}
+
+// Catches whatever the client sends between its request and our reply, so it
+// can go out as the first write to the target.
+static void readEarlyData(std::shared_ptr<ControlBlock> cb)
+{
+    using boost::asio::buffer;
+    using boost::system::error_code;
+    
+    cb->earlyData.reset(new std::vector<char>(earlyDataSize));
+    cb->earlyPending = true;
+    cb->peer.async_receive(buffer(*cb->earlyData), error_branch([cb](error_code const&){
+        // Cancelled once connected, or an error the relay will see again.
+        cb->earlyPending = false;
+        if(cb->connected)
+            relayConnected(std::move(cb));
+    }, [cb](std::size_t bytes){
+        YASOCKS_PROBE3(relay__read, cb->trace->id(), static_cast<int>(RelayDirection::Upstream), bytes);
+        cb->earlyBytes = bytes;
+        cb->earlyPending = false;
+        if(cb->connected)
+            relayConnected(std::move(cb));
+    }));
+}
+
+static ConnectionStatus connectStatus(boost::system::error_code const& e)
+{
+    switch(e.value())
+    {
+        case boost::asio::error::network_unreachable:
+            return ConnectionStatus::NetworkUnreachable;
+        case boost::asio::error::host_unreachable:
+            return ConnectionStatus::HostUnreachable;
+        case boost::asio::error::connection_refused:
+            return ConnectionStatus::ConnectionRefused;
+        case boost::asio::error::timed_out:
+            return ConnectionStatus::TtlExpired;
+        default:
+            return ConnectionStatus::GeneralFailure;
+    }
+}
+
+static void connectTarget(std::shared_ptr<ControlBlock> cb, std::size_t index)
+{
+    using boost::system::error_code;
+    
+    auto const& started = std::chrono::steady_clock::now();
+    error_code error;
+    cb->target.close(error);
+    destinationHealth().recordAttempt(cb->targetEndpoints[index]);
+    cb->target.async_connect(cb->targetEndpoints[index], error_branch([cb, index](error_code const& e){
+        auto status = connectStatus(e);
+        logging::debug("%1%: %2%", cb->targetEndpoints[index], e.message());
+        destinationHealth().recordFailure(cb->targetEndpoints[index], status);
+        if(index + 1 < cb->targetEndpoints.size())
+            connectTarget(std::move(cb), index + 1);
+        else
+        {
+            YASOCKS_PROBE2(connect__end, cb->trace->id(), static_cast<int>(status));
+            sendConnError(status, std::move(cb));
+        }
+    }, [cb, index, started]{
+        destinationHealth().recordSuccess(cb->targetEndpoints[index], std::chrono::steady_clock::now() - started);
+        YASOCKS_PROBE2(connect__end, cb->trace->id(), static_cast<int>(ConnectionStatus::Granted));
+        auto const& profile = selectSocketProfile(cb->peer_endpoint, cb->targetEndpoints[index]);
+        logging::debug("Connected, socket profile %1%.", profile.name);
+        applySocketProfile(cb->peer, profile);
+        applySocketProfile(cb->target, profile);
+        makeConnectionResponse(ConnectionStatus::Granted, cb->connectionResponse, cb->target.local_endpoint());
+        cb->relayBufferSize = profile.relayBufferSize;
+        cb->connected = true;
+        if(cb->earlyPending)
+        {
+            error_code error;
+            cb->peer.cancel(error);             // The read handler takes over
+        }
+        else
+            relayConnected(std::move(cb));
+    }));
+}
+
+static void serve_connect(std::shared_ptr<ControlBlock> cb)
+{
     using boost::asio::ip::tcp;
     
     using boost::system::error_code;
@@ -189,45 +409,34 @@ static void serve_connect(std::shared_ptr<ControlBlock> cb)
                                              boost::lexical_cast<std::string>(request.destPort.toHost())
     );
     logging::debug("%1%:%2%", query.host_name(), query.service_name());
+    if(optimisticData)
+        readEarlyData(cb);
+    if(YASOCKS_PROBE_ENABLED(resolve__start))
+        YASOCKS_PROBE3(resolve__start, cb->trace->id(), query.host_name().c_str(), request.destPort.toHost());
     cb->tcp_resolver
     .async_resolve(query, error_branch([cb](error_code const& e){
+        YASOCKS_PROBE2(resolve__end, cb->trace->id(), e.value());
         logging::debug("%1%", e.message());
         sendConnError(ConnectionStatus::HostUnreachable, std::move(cb));
     }, [cb, filter](tcp::resolver::iterator i){
+        YASOCKS_PROBE2(resolve__end, cb->trace->id(), 0);
         logging::debug("Resolving finished, trying to connect.");
         auto filtered = boost::make_filter_iterator(filter, i);
         auto end = boost::make_filter_iterator(filter, tcp::resolver::iterator());
-        if(filtered == end)
+        ConnectionStatus cachedStatus = ConnectionStatus::GeneralFailure;
+        cb->targetEndpoints.assign(filtered, end);
+        if(cb->targetEndpoints.empty())
             sendConnError(ConnectionStatus::BannedByRuleset, std::move(cb));
+        else if(!destinationHealth().arrange(cb->targetEndpoints, cachedStatus))
+        {
+            YASOCKS_PROBE2(connect__cached, cb->trace->id(), static_cast<int>(cachedStatus));
+            logging::debug("All destinations backing off.");
+            sendConnError(cachedStatus, std::move(cb));
+        }
         else
         {
-            boost::asio::async_connect(cb->target, filtered, end, error_branch([cb](error_code const& e){
-                auto ecode = e.value();
-                switch(ecode)
-                {
-                    case boost::asio::error::network_unreachable:
-                        sendConnError(ConnectionStatus::NetworkUnreachable, std::move(cb));
-                        break;
-                    case boost::asio::error::host_unreachable:
-                        sendConnError(ConnectionStatus::HostUnreachable, std::move(cb));
-                        break;
-                    case boost::asio::error::connection_refused:
-                        sendConnError(ConnectionStatus::ConnectionRefused, std::move(cb));
-                        break;
-                    case boost::asio::error::timed_out:
-                        sendConnError(ConnectionStatus::TtlExpired, std::move(cb));
-                        break;
-                    default:
-                        sendConnError(ConnectionStatus::GeneralFailure, std::move(cb));
-                        break;
-                }
-            }, [cb](decltype(filtered)){
-                logging::debug("Connected.");
-                makeConnectionResponse(ConnectionStatus::Granted, cb->connectionResponse, cb->target.local_endpoint());
-                async_write(cb->peer, buffer(cb->connectionResponse), nosize("async_write", [cb]{
-                    forwardBoth(std::move(cb->peer), std::move(cb->target), 64 * 1024);
-                }));
-            }));
+            YASOCKS_PROBE1(connect__start, cb->trace->id());
+            connectTarget(std::move(cb), 0);
         }
     }));
 }
@@ -249,7 +458,10 @@ void handle_client(TCPSocket&& peer, TCPEndpoint&& peer_endpoint)
     using boost::asio::async_write;
     std::shared_ptr<ControlBlock> cb(new ControlBlock(std::move(peer), std::move(peer_endpoint)));
     logging::info("Connection from %1%:%2%", cb->peer_endpoint.address().to_string(), cb->peer_endpoint.port());
+    if(YASOCKS_PROBE_ENABLED(accept))
+        YASOCKS_PROBE3(accept, cb->trace->id(), cb->peer_endpoint.address().to_string().c_str(), cb->peer_endpoint.port());
     async_read(cb->peer, makeBuffer(cb->clientGreeting.header), nosize("async_read", [cb]{
+        YASOCKS_PROBE2(handshake, cb->trace->id(), static_cast<int>(HandshakeStage::Greeting));
         auto& greeting = cb->clientGreeting;
         auto const& header = greeting.header;
         
@@ -258,6 +470,7 @@ void handle_client(TCPSocket&& peer, TCPEndpoint&& peer_endpoint)
         else
         {
             async_read(cb->peer, buffer(greeting.authMethods, header.numAuthMethods), nosize("async_read", [cb]{
+                YASOCKS_PROBE2(handshake, cb->trace->id(), static_cast<int>(HandshakeStage::AuthMethods));
                 auto const& greeting = cb->clientGreeting;
                 auto const& header = greeting.header;
                 auto const& firstMethod = greeting.authMethods;
@@ -273,12 +486,15 @@ void handle_client(TCPSocket&& peer, TCPEndpoint&& peer_endpoint)
                 {
                     cb->serverGreeting.chosenAuthMethod = AuthMethod::NoAuth;
                     async_write(cb->peer, makeBuffer(cb->serverGreeting), nosize("async_write", [cb]{
+                        YASOCKS_PROBE2(handshake, cb->trace->id(), static_cast<int>(HandshakeStage::MethodChosen));
                         async_read(cb->peer, makeBuffer(cb->connectionRequest.header), nosize("async_read", [cb]{
+                            YASOCKS_PROBE2(handshake, cb->trace->id(), static_cast<int>(HandshakeStage::RequestHeader));
                             auto& request = cb->connectionRequest;
                             auto const& header = request.header;
                             bool addressValid = readAddress(cb->peer, header.addressType, request.destAddress, [cb]{
                                 auto& request = cb->connectionRequest;
                                 async_read(cb->peer, makeBuffer(request.destPort.repr), nosize("async_read", [cb]{
+                                    YASOCKS_PROBE2(handshake, cb->trace->id(), static_cast<int>(HandshakeStage::RequestComplete));
                                     if(!checkClient(cb->peer_endpoint, cb->serverGreeting.chosenAuthMethod))
                                         sendConnError(ConnectionStatus::BannedByRuleset, std::move(cb));
                                     else
@@ -6,6 +6,9 @@
 typedef boost::asio::ip::tcp::socket TCPSocket;
 typedef boost::asio::ip::tcp::endpoint TCPEndpoint;
 
+// Relay client bytes sent before the CONNECT reply as soon as the target is up.
+void setOptimisticData(bool enabled);
+
 void handle_client(TCPSocket&& peer, TCPEndpoint&& peer_endpoint);
 
 #endif
@@ -1,9 +1,15 @@
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <string>
 #include <utility>
 
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/io_service.hpp>
 
+#include <boost/lexical_cast.hpp>
+
+#include "destination_health.h"
 #include "error_handler.h"
 #include "handle_client.h"
 
@@ -33,16 +39,70 @@ private:
     TCPEndpoint peer_endpoint;
 };
 
+static bool optionValue(std::string const& arg, char const* name, std::string& value)
+{
+    std::string const& prefix = std::string(name) + "=";
+    if(arg.compare(0, prefix.size(), prefix) != 0)
+        return false;
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+// lexical_cast<unsigned> wraps negative numbers around instead of failing.
+static unsigned unsignedValue(std::string const& value)
+{
+    if(value.empty() || value[0] == '-')
+        throw boost::bad_lexical_cast();
+    return boost::lexical_cast<unsigned>(value);
+}
+
+static bool parseOption(std::string const& arg, HealthConfig& health)
+{
+    using boost::lexical_cast;
+    std::string value;
+    if(arg == "--optimistic-data")
+        setOptimisticData(true);
+    else if(optionValue(arg, "--backoff", value))
+        health.backoff = std::chrono::seconds(unsignedValue(value));
+    else if(optionValue(arg, "--max-backoff", value))
+        health.maxBackoff = std::chrono::seconds(unsignedValue(value));
+    else if(optionValue(arg, "--failure-threshold", value))
+        health.failureThreshold = unsignedValue(value);
+    else if(optionValue(arg, "--probe-rate", value))
+        health.probeProbability = std::min(std::max(lexical_cast<double>(value), 0.0), 1.0);
+    else
+        return false;
+    return true;
+}
+
 int main(int argc, char **argv) {
-    if(argc != 3)
+    HealthConfig health;
+    int arg = 1;
+    try
+    {
+        for(; arg < argc && std::string(argv[arg]).compare(0, 2, "--") == 0; ++arg)
+            if(!parseOption(argv[arg], health))
+                break;
+    }
+    catch(boost::bad_lexical_cast const&)
+    {
+        argc = 0;
+    }
+    if(argc - arg != 2)
     {
-        std::cerr << "Usage: " << argv[0] << " ip addr" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " [options] ip addr" << std::endl
+                  << "  --optimistic-data         relay client data sent before the CONNECT reply" << std::endl
+                  << "  --backoff=SECONDS         first back-off window for failing destinations" << std::endl
+                  << "  --max-backoff=SECONDS     longest back-off window" << std::endl
+                  << "  --failure-threshold=N     consecutive failures before backing off" << std::endl
+                  << "  --probe-rate=P            chance to probe a backed-off destination" << std::endl;
         return 1;
     }
+    destinationHealth().configure(health);
     boost::asio::io_service io_service;
     typedef boost::asio::ip::tcp::resolver resolver_type;
     resolver_type resolver(io_service);
-    resolver_type::query query(argv[1], argv[2]);
+    resolver_type::query query(argv[arg], argv[arg + 1]);
     auto addr = resolver.resolve(query);
     Acceptor acceptor(io_service, addr->endpoint());
     acceptor.exec();
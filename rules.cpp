@@ -11,3 +11,22 @@ bool checkTarget(const boost::asio::ip::tcp::endpoint& target, Command command)
         return true;
     return false;
 }
+
+SocketProfile const& selectSocketProfile(const boost::asio::ip::tcp::endpoint&, const boost::asio::ip::tcp::endpoint& target)
+{
+    static struct
+    {
+        unsigned short port;
+        SocketProfile const* profile;
+    } const portProfiles[] = {
+        {   22,     findSocketProfile("interactive")    },          // ssh
+        {   23,     findSocketProfile("interactive")    },          // telnet
+        {   3389,   findSocketProfile("interactive")    },          // rdp
+        {   873,    findSocketProfile("bulk")           },          // rsync
+    };
+    
+    for(auto const& rule : portProfiles)
+        if(rule.port == target.port() && rule.profile)
+            return *rule.profile;
+    return defaultSocketProfile();
+}
@@ -4,9 +4,11 @@
 #include <boost/asio/ip/tcp.hpp>
 
 #include "protocol_types.h"
+#include "socket_profile.h"
 
 bool checkClient(boost::asio::ip::tcp::endpoint const& client, AuthMethod method);
 bool checkTarget(boost::asio::ip::tcp::endpoint const& target, Command command);
+SocketProfile const& selectSocketProfile(boost::asio::ip::tcp::endpoint const& client, boost::asio::ip::tcp::endpoint const& target);
 
 struct TargetChecker
 {
@@ -0,0 +1,85 @@
+#include <cerrno>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "socket_profile.h"
+
+#include "logging.h"
+
+static SocketProfile const profiles[] = {
+    //  name            nodelay sndbuf      rcvbuf      lowat   idle    intvl   cnt     cc      relay
+    {   "default",      false,  0,          0,          0,      0,      0,      0,      "",     64 * 1024   },
+    {   "interactive",  true,   0,          0,          16384,  60,     10,     6,      "",     16 * 1024   },
+    {   "bulk",         false,  0,          0,          0,      120,    30,     4,      "",     256 * 1024  },
+};
+
+SocketProfile const& defaultSocketProfile()
+{
+    return profiles[0];
+}
+
+SocketProfile const* findSocketProfile(const std::string& name)
+{
+    for(auto const& profile : profiles)
+        if(profile.name == name)
+            return &profile;
+    return nullptr;
+}
+
+template <typename Option>
+static void setOption(boost::asio::ip::tcp::socket& socket, Option const& option, char const* optionName)
+{
+    boost::system::error_code error;
+    socket.set_option(option, error);
+    if(error)
+        logging::debug("%1%: %2%", optionName, error.message());
+}
+
+static void setRawOption(boost::asio::ip::tcp::socket& socket, int level, int option, void const* value, socklen_t length, char const* optionName)
+{
+    if(::setsockopt(socket.native_handle(), level, option, value, length) != 0)
+        logging::debug("%1%: %2%", optionName, boost::system::error_code(errno, boost::system::system_category()).message());
+}
+
+static void setRawOption(boost::asio::ip::tcp::socket& socket, int level, int option, int value, char const* optionName)
+{
+    setRawOption(socket, level, option, &value, sizeof(value), optionName);
+}
+
+void applySocketProfile(boost::asio::ip::tcp::socket& socket, const SocketProfile& profile)
+{
+    using boost::asio::ip::tcp;
+    using boost::asio::socket_base;
+    
+    if(profile.noDelay)
+        setOption(socket, tcp::no_delay(true), "TCP_NODELAY");
+    if(profile.sendBuffer != 0)
+        setOption(socket, socket_base::send_buffer_size(profile.sendBuffer), "SO_SNDBUF");
+    if(profile.receiveBuffer != 0)
+        setOption(socket, socket_base::receive_buffer_size(profile.receiveBuffer), "SO_RCVBUF");
+#ifdef TCP_NOTSENT_LOWAT
+    if(profile.notSentLowat != 0)
+        setRawOption(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, profile.notSentLowat, "TCP_NOTSENT_LOWAT");
+#endif
+    if(profile.keepAliveIdle != 0)
+    {
+        setOption(socket, socket_base::keep_alive(true), "SO_KEEPALIVE");
+#ifdef TCP_KEEPIDLE
+        setRawOption(socket, IPPROTO_TCP, TCP_KEEPIDLE, profile.keepAliveIdle, "TCP_KEEPIDLE");
+#endif
+#ifdef TCP_KEEPINTVL
+        if(profile.keepAliveInterval != 0)
+            setRawOption(socket, IPPROTO_TCP, TCP_KEEPINTVL, profile.keepAliveInterval, "TCP_KEEPINTVL");
+#endif
+#ifdef TCP_KEEPCNT
+        if(profile.keepAliveCount != 0)
+            setRawOption(socket, IPPROTO_TCP, TCP_KEEPCNT, profile.keepAliveCount, "TCP_KEEPCNT");
+#endif
+    }
+#ifdef TCP_CONGESTION
+    if(!profile.congestion.empty())
+        setRawOption(socket, IPPROTO_TCP, TCP_CONGESTION, profile.congestion.data(), profile.congestion.size(), "TCP_CONGESTION");
+#endif
+}
@@ -0,0 +1,34 @@
+#ifndef _C43F006A_CB87_11F1_88D2_02FC00000001
+#define _C43F006A_CB87_11F1_88D2_02FC00000001
+
+#include <string>
+
+#include <boost/asio/ip/tcp.hpp>
+
+// Socket options applied to both legs of a session before relaying starts.
+// Zero or empty fields leave the system default alone.
+//
+// The options are set after connect/accept, when the window scale is already
+// negotiated. On Linux an explicit SO_SNDBUF/SO_RCVBUF also disables buffer
+// autotuning and is capped by net.core.wmem_max/rmem_max, so use them only
+// to shrink buffers, never to make bulk transfers faster.
+struct SocketProfile
+{
+    std::string name;
+    bool noDelay;                       // TCP_NODELAY
+    int sendBuffer;                     // SO_SNDBUF, bytes
+    int receiveBuffer;                  // SO_RCVBUF, bytes
+    int notSentLowat;                   // TCP_NOTSENT_LOWAT, bytes
+    int keepAliveIdle;                  // TCP_KEEPIDLE, seconds; enables SO_KEEPALIVE
+    int keepAliveInterval;              // TCP_KEEPINTVL, seconds
+    int keepAliveCount;                 // TCP_KEEPCNT
+    std::string congestion;             // TCP_CONGESTION
+    std::size_t relayBufferSize;        // Relay chunk size per direction
+};
+
+SocketProfile const& defaultSocketProfile();
+SocketProfile const* findSocketProfile(std::string const& name);
+
+void applySocketProfile(boost::asio::ip::tcp::socket& socket, SocketProfile const& profile);
+
+#endif
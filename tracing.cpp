@@ -0,0 +1,31 @@
+#include "tracing.h"
+
+#ifdef YASOCKS_HAVE_SDT
+#define YASOCKS_PROBE_SEMAPHORE_DEFINE(name)\
+    __extension__ unsigned short yasocks_##name##_semaphore __attribute__((section(".probes"))) = 0;\
+
+YASOCKS_PROBE_SEMAPHORE_DEFINE(accept)
+YASOCKS_PROBE_SEMAPHORE_DEFINE(handshake)
+YASOCKS_PROBE_SEMAPHORE_DEFINE(resolve__start)
+YASOCKS_PROBE_SEMAPHORE_DEFINE(resolve__end)
+YASOCKS_PROBE_SEMAPHORE_DEFINE(connect__start)
+YASOCKS_PROBE_SEMAPHORE_DEFINE(connect__end)
+YASOCKS_PROBE_SEMAPHORE_DEFINE(connect__cached)
+YASOCKS_PROBE_SEMAPHORE_DEFINE(relay__read)
+YASOCKS_PROBE_SEMAPHORE_DEFINE(relay__write)
+YASOCKS_PROBE_SEMAPHORE_DEFINE(session__end)
+#endif
+
+static uint64_t nextSessionId = 0;
+
+SessionTrace::SessionTrace():
+sessionId(++nextSessionId),
+bytesUp(0),
+bytesDown(0)
+{
+}
+
+SessionTrace::~SessionTrace()
+{
+    YASOCKS_PROBE3(session__end, sessionId, bytesUp, bytesDown);
+}
@@ -0,0 +1,83 @@
+#ifndef _C41F27CC_CB87_11F1_90D1_02FC00000001
+#define _C41F27CC_CB87_11F1_90D1_02FC00000001
+
+#include <cstddef>
+#include <cstdint>
+
+// USDT probes under the "yasocks" provider. They compile to a nop unless a
+// tracer attaches, and to nothing at all when sys/sdt.h is unavailable.
+//
+// Every probe has a semaphore the tracer raises while attached. Probes whose
+// arguments are costly to build are guarded with YASOCKS_PROBE_ENABLED.
+#ifdef YASOCKS_HAVE_SDT
+#ifndef _SDT_HAS_SEMAPHORES
+#define _SDT_HAS_SEMAPHORES 1
+#endif
+#include <sys/sdt.h>
+#define YASOCKS_PROBE_ENABLED(name)             __builtin_expect(yasocks_##name##_semaphore, 0)
+#define YASOCKS_PROBE1(name, a1)                DTRACE_PROBE1(yasocks, name, a1)
+#define YASOCKS_PROBE2(name, a1, a2)            DTRACE_PROBE2(yasocks, name, a1, a2)
+#define YASOCKS_PROBE3(name, a1, a2, a3)        DTRACE_PROBE3(yasocks, name, a1, a2, a3)
+
+#define YASOCKS_PROBE_SEMAPHORE(name)\
+    __extension__ extern unsigned short yasocks_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")));\
+
+extern "C"
+{
+    YASOCKS_PROBE_SEMAPHORE(accept)
+    YASOCKS_PROBE_SEMAPHORE(handshake)
+    YASOCKS_PROBE_SEMAPHORE(resolve__start)
+    YASOCKS_PROBE_SEMAPHORE(resolve__end)
+    YASOCKS_PROBE_SEMAPHORE(connect__start)
+    YASOCKS_PROBE_SEMAPHORE(connect__end)
+    YASOCKS_PROBE_SEMAPHORE(connect__cached)
+    YASOCKS_PROBE_SEMAPHORE(relay__read)
+    YASOCKS_PROBE_SEMAPHORE(relay__write)
+    YASOCKS_PROBE_SEMAPHORE(session__end)
+}
+#else
+#define YASOCKS_PROBE_ENABLED(name)             false
+#define YASOCKS_PROBE1(name, a1)                do {} while(0)
+#define YASOCKS_PROBE2(name, a1, a2)            do {} while(0)
+#define YASOCKS_PROBE3(name, a1, a2, a3)        do {} while(0)
+#endif
+
+enum class HandshakeStage : int
+{
+    Greeting        = 1,                // Greeting header read
+    AuthMethods     = 2,                // Auth method list read
+    MethodChosen    = 3,                // Server greeting sent
+    RequestHeader   = 4,                // Connection request header read
+    RequestComplete = 5                 // Destination address and port read
+};
+
+enum class RelayDirection : int
+{
+    Upstream    = 0,                    // peer -> target
+    Downstream  = 1                     // target -> peer
+};
+
+// Owns the session id carried by every probe. Fires session__end when the
+// last handshake or relay callback holding it goes away.
+class SessionTrace
+{
+public:
+    SessionTrace();
+    ~SessionTrace();
+
+    uint64_t id() const
+    { return sessionId; }
+
+    void addBytes(RelayDirection direction, std::size_t bytes)
+    { (direction == RelayDirection::Upstream ? bytesUp : bytesDown) += bytes; }
+
+    SessionTrace(SessionTrace const&) = delete;
+    SessionTrace& operator = (SessionTrace const&) = delete;
+
+private:
+    uint64_t sessionId;
+    uint64_t bytesUp;
+    uint64_t bytesDown;
+};
+
+#endif